@@ -0,0 +1,25 @@
+#include <fstream>
+#include "log4tiny.hpp"
+#include "trace_decoder.hpp"
+
+void process_item(const unsigned id) {
+  tinytrace_scope("process item %u", id);
+  for (unsigned step = 0; step < 3; ++step) {
+    tinytrace_scope("step %u of item %u", step, id);
+  }
+}
+
+int main() {
+  {
+    tinytrace_scope("main loop");
+    for (unsigned id = 0; id < 4; ++id) {
+      process_item(id);
+    }
+  }
+
+  // Resulting file can be opened in https://ui.perfetto.dev or chrome://tracing
+  std::ofstream output{"example_2_trace.json"};
+  ::log4tiny::trace::export_chrome_trace(output, ::log4tiny::trace::collect_records(),
+                                         ::log4tiny::trace::call_sites(),
+                                         ::log4tiny::trace::calibrate_ticks_per_microsecond());
+}
@@ -3,6 +3,7 @@
 #include <iostream>
 #include <crc32.hpp>
 #include <format_parser.hpp>
+#include <trace.hpp>
 
 namespace log4tiny {
 
@@ -21,4 +22,16 @@ static constexpr std::string_view format_view = format_char_array;
 ::log4tiny::log<format_view>(_TINYLOG_CALCULATE_CRC32(__FILE__), __LINE__, __VA_ARGS__); \
 }
 
+#define _TINYLOG_CONCATENATE_IMPL(first, second) first##second
+#define _TINYLOG_CONCATENATE(first, second) _TINYLOG_CONCATENATE_IMPL(first, second)
+
+// Trace scope lasting until the end of enclosing block. Scope variable is suffixed with __COUNTER__ so multiple scopes
+// can be opened in the same block or on the same line
+#define tinytrace_scope(...) _TINYTRACE_EXTRACT_FORMAT(__COUNTER__, __VA_ARGS__)
+
+#define _TINYTRACE_EXTRACT_FORMAT(suffix, format_char_array, ...)                                     \
+const auto _TINYLOG_CONCATENATE(_tinytrace_scope_, suffix) = ::log4tiny::trace::begin_scope(          \
+        [] { return std::string_view{format_char_array}; }, _TINYLOG_CALCULATE_CRC32(__FILE__), __LINE__ \
+        __VA_OPT__(,) __VA_ARGS__);
+
 }
@@ -0,0 +1,424 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <crc32.hpp>
+#include <format_parser.hpp>
+
+namespace log4tiny::trace {
+
+// Number of 64-bit words kept per thread. Buffers are rings - once full, the oldest records are overwritten so tracing
+// can stay enabled all the time. End record takes two words, begin record two words plus one per argument
+#ifndef LOG4TINY_TRACE_BUFFER_CAPACITY
+#define LOG4TINY_TRACE_BUFFER_CAPACITY 8192
+#endif
+
+// Number of buffers of exited threads that are kept until collected. Beyond that the oldest ones are reused
+#ifndef LOG4TINY_TRACE_RETIRED_BUFFERS
+#define LOG4TINY_TRACE_RETIRED_BUFFERS 16
+#endif
+
+inline constexpr size_t buffer_capacity = LOG4TINY_TRACE_BUFFER_CAPACITY;
+inline constexpr size_t max_retired_buffers = LOG4TINY_TRACE_RETIRED_BUFFERS;
+inline constexpr size_t max_scope_arguments = 4;
+inline constexpr size_t record_header_words = 2;
+
+static_assert(buffer_capacity >= record_header_words + max_scope_arguments,
+              "Trace buffer must be able to hold the largest record");
+
+// Read free running cycle counter of the core. On architectures without user-accessible counter steady_clock
+// nanoseconds are used instead
+inline uint64_t read_cycle_counter() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t value;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+  return value;
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Measure how many cycle counter ticks elapse per microsecond by busy waiting for given duration. Result is needed to
+// convert record timestamps to wall time when decoding
+inline double calibrate_ticks_per_microsecond(const std::chrono::microseconds duration = std::chrono::milliseconds{10}) {
+  const auto start_time = std::chrono::steady_clock::now();
+  const uint64_t start_ticks = read_cycle_counter();
+  while (std::chrono::steady_clock::now() - start_time < duration) {
+  }
+  const uint64_t end_ticks = read_cycle_counter();
+  const auto elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start_time);
+  return static_cast<double>(end_ticks - start_ticks) / elapsed.count();
+}
+
+enum class RecordKind : uint8_t {
+  begin,
+  end
+};
+
+enum class ArgumentKind : uint8_t {
+  signed_int,
+  unsigned_int,
+  floating,
+  pointer
+};
+
+// Decoded begin/end event. Call site is identified by hash of the file path, line number and hash of the format string
+// (so scopes sharing a line are told apart) - format string itself is never copied and is resolved by the decoder from
+// the call site dictionary. Arguments are kept as raw 64-bit values together with information on how to reinterpret
+// them
+struct Record {
+  uint64_t timestamp;
+  uint32_t file_hash;
+  uint32_t line;
+  uint8_t format_hash;
+  RecordKind kind;
+  uint8_t argument_count;
+  std::array<ArgumentKind, max_scope_arguments> argument_kinds;
+  std::array<uint64_t, max_scope_arguments> arguments;
+};
+
+// Records are stored as a header word followed by timestamp and arguments. Header layout:
+// [63:40] file hash, [39:32] format hash, [31:12] line, [11:4] argument kinds (2 bits each), [3:1] argument count,
+// [0] record kind. Bits [63:12] form the call site key. Hashes are truncated and lines above 2^20 wrap - conflicting
+// keys are detected when call sites register
+inline constexpr uint32_t max_file_hash = (1U << 24) - 1;
+inline constexpr uint32_t max_format_hash = (1U << 8) - 1;
+inline constexpr uint32_t max_line = (1U << 20) - 1;
+
+constexpr uint64_t call_site_key(const uint32_t file_hash, const uint32_t line, const uint32_t format_hash) {
+  return (static_cast<uint64_t>(file_hash & max_file_hash) << 28) |
+         (static_cast<uint64_t>(format_hash & max_format_hash) << 20) | (line & max_line);
+}
+
+constexpr uint64_t encode_header(const RecordKind kind, const uint64_t key, const uint64_t argument_count = 0,
+                                 const uint64_t packed_argument_kinds = 0) {
+  return (key << 12) | (packed_argument_kinds << 4) | (argument_count << 1) | static_cast<uint64_t>(kind);
+}
+
+constexpr size_t record_length(const uint64_t header) {
+  return record_header_words + ((header >> 1) & 0x7);
+}
+
+constexpr Record decode_record(const uint64_t *words) {
+  const uint64_t header = words[0];
+  Record record{.timestamp = words[1], .file_hash = static_cast<uint32_t>(header >> 40),
+          .line = static_cast<uint32_t>((header >> 12) & max_line),
+          .format_hash = static_cast<uint8_t>((header >> 32) & max_format_hash), .kind = static_cast<RecordKind>(header & 0x1),
+          .argument_count = static_cast<uint8_t>((header >> 1) & 0x7), .argument_kinds = {}, .arguments = {}};
+  for (size_t index = 0; index < record.argument_count; ++index) {
+    record.argument_kinds[index] = static_cast<ArgumentKind>((header >> (4 + 2 * index)) & 0x3);
+    record.arguments[index] = words[record_header_words + index];
+  }
+  return record;
+}
+
+template<typename T>
+constexpr ArgumentKind argument_kind_of() {
+  if constexpr (std::is_floating_point_v<T>) {
+    return ArgumentKind::floating;
+  } else if constexpr (std::is_pointer_v<T>) {
+    return ArgumentKind::pointer;
+  } else if constexpr (std::is_signed_v<T>) {
+    return ArgumentKind::signed_int;
+  } else {
+    return ArgumentKind::unsigned_int;
+  }
+}
+
+template<typename... T>
+constexpr uint64_t pack_argument_kinds() {
+  uint64_t packed = 0;
+  uint64_t shift = 0;
+  ((packed |= static_cast<uint64_t>(argument_kind_of<T>()) << shift, shift += 2), ...);
+  return packed;
+}
+
+template<typename T>
+constexpr uint64_t encode_argument(const T &argument) {
+  if constexpr (std::is_floating_point_v<T>) {
+    return std::bit_cast<uint64_t>(static_cast<double>(argument));
+  } else if constexpr (std::is_pointer_v<T>) {
+    return reinterpret_cast<uintptr_t>(argument);
+  } else if constexpr (std::is_signed_v<T>) {
+    return static_cast<uint64_t>(static_cast<int64_t>(argument));
+  } else {
+    return static_cast<uint64_t>(argument);
+  }
+}
+
+// Only values that can be reproduced from a 64-bit copy are allowed - strings would have to be dereferenced
+// after the scope has ended
+template<typename T>
+concept IsTraceArgument = std::is_arithmetic_v<T> or
+                          (std::is_pointer_v<T> and not std::is_convertible_v<T, const char *>);
+
+// Per-thread ring of record words. Only the owning thread writes; snapshot() may be called from any thread at any time.
+// Writer moves `tail` (start of the oldest intact record) past records it is about to overwrite before touching their
+// words, so a reader that copied the ring and then loads `tail` knows which part of its copy is intact
+class Buffer {
+public:
+  explicit Buffer(const uint32_t thread_id) : thread_id(thread_id), words() {}
+
+  void push(const uint64_t *record_words, const size_t count) {
+    const uint64_t begin = written.load(std::memory_order_relaxed);
+    const uint64_t end = begin + count;
+    uint64_t oldest = tail.load(std::memory_order_relaxed);
+    if (oldest + buffer_capacity < end) {
+      do {
+        oldest += record_length(words[oldest % buffer_capacity].load(std::memory_order_relaxed));
+      } while (oldest + buffer_capacity < end);
+      tail.store(oldest, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+    for (size_t index = 0; index < count; ++index) {
+      words[(begin + index) % buffer_capacity].store(record_words[index], std::memory_order_relaxed);
+    }
+    written.store(end, std::memory_order_release);
+  }
+
+  void push(const Record &record) {
+    std::array<uint64_t, record_header_words + max_scope_arguments> record_words{};
+    uint64_t packed_argument_kinds = 0;
+    for (size_t index = 0; index < record.argument_count; ++index) {
+      packed_argument_kinds |= static_cast<uint64_t>(record.argument_kinds[index]) << (2 * index);
+      record_words[record_header_words + index] = record.arguments[index];
+    }
+    record_words[0] = encode_header(record.kind, call_site_key(record.file_hash, record.line, record.format_hash),
+                                    record.argument_count, packed_argument_kinds);
+    record_words[1] = record.timestamp;
+    push(record_words.data(), record_header_words + record.argument_count);
+  }
+
+  // Drop all stored records. May be called only by the owning thread
+  void clear() {
+    tail.store(written.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  }
+
+  // Return stored records from the oldest to the newest. Records overwritten while copying are skipped
+  std::vector<Record> snapshot() const {
+    const uint64_t end = written.load(std::memory_order_acquire);
+    const uint64_t window_begin = end > buffer_capacity ? end - buffer_capacity : 0;
+    std::vector<uint64_t> copy(end - window_begin);
+    for (uint64_t index = window_begin; index < end; ++index) {
+      copy[index - window_begin] = words[index % buffer_capacity].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    std::vector<Record> result{};
+    uint64_t index = std::max(tail.load(std::memory_order_relaxed), window_begin);
+    while (index < end) {
+      const uint64_t length = record_length(copy[index - window_begin]);
+      if (index + length > end) {
+        break;
+      }
+      result.push_back(decode_record(&copy[index - window_begin]));
+      index += length;
+    }
+    return result;
+  }
+
+  // Prepare buffer for a new owning thread. Must not be called while any thread writes to the buffer
+  void reset(const uint32_t new_thread_id) {
+    thread_id = new_thread_id;
+    clear();
+  }
+
+  uint32_t get_thread_id() const {
+    return thread_id;
+  }
+
+private:
+  uint32_t thread_id;
+  std::atomic<uint64_t> written{0};
+  std::atomic<uint64_t> tail{0};
+  std::array<std::atomic<uint64_t>, buffer_capacity> words;
+};
+
+// Buffers of running threads are `active`. After thread exit its buffer is `retired` until collected once, then it
+// goes to `free` to be handed to the next thread. Retired and free lists are capped, so threads that keep being
+// created do not grow memory usage
+struct Registry {
+  std::mutex mutex;
+  std::vector<std::unique_ptr<Buffer>> active;
+  std::deque<std::unique_ptr<Buffer>> retired;
+  std::vector<std::unique_ptr<Buffer>> free;
+  std::map<uint64_t, std::string_view> call_sites;
+  uint32_t next_thread_id = 1;
+};
+
+inline Registry &registry() {
+  static Registry instance{};
+  return instance;
+}
+
+// Must be called with registry mutex held
+inline void recycle_buffer(Registry &instance, std::unique_ptr<Buffer> buffer) {
+  if (instance.free.size() < max_retired_buffers) {
+    instance.free.push_back(std::move(buffer));
+  }
+}
+
+inline Buffer *acquire_buffer() {
+  auto &instance = registry();
+  const std::lock_guard lock{instance.mutex};
+  std::unique_ptr<Buffer> buffer{};
+  if (instance.free.empty()) {
+    buffer = std::make_unique<Buffer>(instance.next_thread_id++);
+  } else {
+    buffer = std::move(instance.free.back());
+    instance.free.pop_back();
+    buffer->reset(instance.next_thread_id++);
+  }
+  return instance.active.emplace_back(std::move(buffer)).get();
+}
+
+inline void release_buffer(Buffer *const buffer) {
+  auto &instance = registry();
+  const std::lock_guard lock{instance.mutex};
+  const auto owner = std::ranges::find_if(instance.active, [buffer](const auto &active) {
+    return active.get() == buffer;
+  });
+  if (owner == instance.active.end()) {
+    return;
+  }
+  instance.retired.push_back(std::move(*owner));
+  instance.active.erase(owner);
+  if (instance.retired.size() > max_retired_buffers) {
+    recycle_buffer(instance, std::move(instance.retired.front()));
+    instance.retired.pop_front();
+  }
+}
+
+// Hands the buffer back to the registry when its thread exits
+struct BufferLease {
+  BufferLease() : buffer(acquire_buffer()) {}
+
+  BufferLease(const BufferLease &) = delete;
+
+  BufferLease &operator=(const BufferLease &) = delete;
+
+  ~BufferLease() {
+    release_buffer(buffer);
+  }
+
+  Buffer *const buffer;
+};
+
+// Buffer of calling thread
+inline Buffer &thread_buffer() {
+  thread_local const BufferLease lease{};
+  return *lease.buffer;
+}
+
+// Registers format string of a trace scope so the decoder can name events. Meant to be a function-local static so
+// registration happens once per call site. Two different formats resolving to the same key would make the decoder
+// name one of the scopes wrongly, so such registration throws
+struct CallSite {
+  CallSite(const uint64_t key, const std::string_view &format) {
+    auto &instance = registry();
+    const std::lock_guard lock{instance.mutex};
+    if (const auto [call_site, is_inserted] = instance.call_sites.emplace(key, format);
+            not is_inserted and call_site->second != format) {
+      throw std::logic_error("Trace scopes \"" + std::string{call_site->second} + "\" and \"" + std::string{format} +
+                             "\" resolve to the same call site key");
+    }
+  }
+};
+
+inline std::map<uint64_t, std::string_view> call_sites() {
+  auto &instance = registry();
+  const std::lock_guard lock{instance.mutex};
+  return instance.call_sites;
+}
+
+struct ThreadRecords {
+  uint32_t thread_id;
+  std::vector<Record> records;
+};
+
+// Snapshot buffers of all threads. Safe to call while other threads are tracing. Buffers of exited threads are
+// reported once and then reused
+inline std::vector<ThreadRecords> collect_records() {
+  auto &instance = registry();
+  const std::lock_guard lock{instance.mutex};
+  std::vector<ThreadRecords> result{};
+  for (const auto &buffer: instance.active) {
+    result.push_back(ThreadRecords{.thread_id = buffer->get_thread_id(), .records = buffer->snapshot()});
+  }
+  for (auto &buffer: instance.retired) {
+    result.push_back(ThreadRecords{.thread_id = buffer->get_thread_id(), .records = buffer->snapshot()});
+    recycle_buffer(instance, std::move(buffer));
+  }
+  instance.retired.clear();
+  return result;
+}
+
+// Emits end record when leaving the scope. Instances are created only by begin_scope()
+class Scope {
+public:
+  Scope(const Scope &) = delete;
+
+  Scope &operator=(const Scope &) = delete;
+
+  ~Scope() {
+    const std::array<uint64_t, record_header_words> record_words{end_header, read_cycle_counter()};
+    buffer->push(record_words.data(), record_words.size());
+  }
+
+private:
+  template<typename Format, typename... T>
+  friend Scope begin_scope(Format, uint32_t file_hash, uint32_t line, const T &... args);
+
+  Scope(Buffer &buffer, const uint64_t key) : buffer(&buffer), end_header(encode_header(RecordKind::end, key)) {}
+
+  Buffer *const buffer;
+  const uint64_t end_header;
+};
+
+// Format string is passed as a type (captureless lambda returning the literal) - referring to a function-local static
+// as a template argument crashes GCC 12 when the scope is inside a template
+template<typename Format>
+struct FormatHolder {
+  static constexpr std::string_view value = Format{}();
+  static constexpr uint32_t hash = compute_crc32(value.data(), value.size());
+};
+
+template<typename Format, typename... T>
+[[nodiscard]] Scope begin_scope(Format, const uint32_t file_hash, const uint32_t line, const T &... args) {
+  ::log4tiny::verify_format_with_arguments<FormatHolder<Format>::value>(args...);
+  static_assert(sizeof...(T) <= max_scope_arguments, "Too many arguments passed to trace scope");
+  static_assert((IsTraceArgument<T> and ...), "Trace scope arguments must be arithmetic values or non-string pointers");
+
+  const uint64_t key = call_site_key(file_hash, line, FormatHolder<Format>::hash);
+  static const CallSite call_site{key, FormatHolder<Format>::value};
+
+  Buffer &buffer = thread_buffer();
+  std::array<uint64_t, record_header_words + sizeof...(T)> record_words{
+          encode_header(RecordKind::begin, key, sizeof...(T), pack_argument_kinds<T...>()), 0,
+          encode_argument(args)...};
+  // Timestamp is taken as late as possible so argument encoding is not attributed to the traced scope
+  record_words[1] = read_cycle_counter();
+  buffer.push(record_words.data(), record_words.size());
+  return Scope{buffer, key};
+}
+
+}
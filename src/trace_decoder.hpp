@@ -0,0 +1,278 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cwchar>
+#include <map>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include <format_parser.hpp>
+#include <trace.hpp>
+
+namespace log4tiny::trace {
+
+inline int64_t argument_as_signed(const uint64_t raw, const ArgumentKind kind) {
+  if (kind == ArgumentKind::floating) {
+    return static_cast<int64_t>(std::bit_cast<double>(raw));
+  }
+  return static_cast<int64_t>(raw);
+}
+
+inline uint64_t argument_as_unsigned(const uint64_t raw, const ArgumentKind kind) {
+  if (kind == ArgumentKind::floating) {
+    return static_cast<uint64_t>(std::bit_cast<double>(raw));
+  }
+  return raw;
+}
+
+inline double argument_as_floating(const uint64_t raw, const ArgumentKind kind) {
+  switch (kind) {
+    case ArgumentKind::floating:
+      return std::bit_cast<double>(raw);
+    case ArgumentKind::signed_int:
+      return static_cast<double>(static_cast<int64_t>(raw));
+    case ArgumentKind::unsigned_int:
+    case ArgumentKind::pointer:
+    default:
+      return static_cast<double>(raw);
+  }
+}
+
+template<typename... T>
+std::string print_formatted(const std::string &format, const T &... args) {
+  const int length = std::snprintf(nullptr, 0, format.c_str(), args...);
+  if (length <= 0) {
+    return {};
+  }
+  std::string result(static_cast<size_t>(length), '\0');
+  std::snprintf(result.data(), result.size() + 1, format.c_str(), args...);
+  return result;
+}
+
+// Integers are stored as 64-bit values - convert them back to the type implied by the length modifier, so printing
+// matches printf (i.e. truncation of "%hhd" or "%x" of a negative int)
+template<typename Function>
+std::string print_signed(const std::string_view &length, const int64_t value, const Function &print) {
+  if (length == "hh") {
+    return print(static_cast<signed char>(value));
+  } else if (length == "h") {
+    return print(static_cast<short>(value));
+  } else if (length == "l") {
+    return print(static_cast<long>(value));
+  } else if (length == "ll") {
+    return print(static_cast<long long>(value));
+  } else if (length == "j") {
+    return print(static_cast<intmax_t>(value));
+  } else if (length == "z") {
+    return print(static_cast<std::make_signed_t<size_t>>(value));
+  } else if (length == "t") {
+    return print(static_cast<ptrdiff_t>(value));
+  }
+  return print(static_cast<int>(value));
+}
+
+template<typename Function>
+std::string print_unsigned(const std::string_view &length, const uint64_t value, const Function &print) {
+  if (length == "hh") {
+    return print(static_cast<unsigned char>(value));
+  } else if (length == "h") {
+    return print(static_cast<unsigned short>(value));
+  } else if (length == "l") {
+    return print(static_cast<unsigned long>(value));
+  } else if (length == "ll") {
+    return print(static_cast<unsigned long long>(value));
+  } else if (length == "j") {
+    return print(static_cast<uintmax_t>(value));
+  } else if (length == "z") {
+    return print(static_cast<size_t>(value));
+  } else if (length == "t") {
+    return print(static_cast<std::make_unsigned_t<ptrdiff_t>>(value));
+  }
+  return print(static_cast<unsigned>(value));
+}
+
+// Print single placeholder with arguments starting at first_argument
+inline std::string format_placeholder(const std::string_view &placeholder, const Record &record,
+                                      const size_t first_argument) {
+  const auto star_count = static_cast<size_t>(std::ranges::count(placeholder, '*'));
+  const size_t value_index = first_argument + star_count;
+  if (value_index >= record.argument_count) {
+    return std::string{placeholder};
+  }
+
+  const char specifier = placeholder.back();
+  const auto length_begin = placeholder.find_first_of("hljztL");
+  const std::string_view length = length_begin == std::string_view::npos ? std::string_view{} :
+                                  placeholder.substr(length_begin, placeholder.size() - 1 - length_begin);
+  std::string format{placeholder};
+
+  const auto print = [&](const auto &value) {
+    if (star_count == 0) {
+      return print_formatted(format, value);
+    }
+    const auto first_star = static_cast<int>(argument_as_signed(record.arguments[first_argument],
+                                                                 record.argument_kinds[first_argument]));
+    if (star_count == 1) {
+      return print_formatted(format, first_star, value);
+    }
+    const auto second_star = static_cast<int>(argument_as_signed(record.arguments[first_argument + 1],
+                                                                  record.argument_kinds[first_argument + 1]));
+    return print_formatted(format, first_star, second_star, value);
+  };
+
+  const uint64_t raw = record.arguments[value_index];
+  const ArgumentKind kind = record.argument_kinds[value_index];
+  switch (specifier) {
+    case 'd':
+    case 'i':
+      return print_signed(length, argument_as_signed(raw, kind), print);
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+      return print_unsigned(length, argument_as_unsigned(raw, kind), print);
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+      if (length == "L") {
+        return print(static_cast<long double>(argument_as_floating(raw, kind)));
+      }
+      return print(argument_as_floating(raw, kind));
+    case 'c':
+      if (length == "l") {
+        return print(static_cast<wint_t>(argument_as_signed(raw, kind)));
+      }
+      return print(static_cast<int>(argument_as_signed(raw, kind)));
+    case 'p':
+    case 's':
+      // Strings are not recorded, so pointer value is the best that can be shown
+      format.erase(length_begin == std::string_view::npos ? format.size() - 1 : length_begin);
+      format += 'p';
+      return print(reinterpret_cast<const void *>(static_cast<uintptr_t>(raw)));
+    case 'n':
+    default:
+      return std::string{};
+  }
+}
+
+// Render format string of a call site with arguments stored in begin record
+inline std::string format_scope_name(const std::string_view &format, const Record &record) {
+  std::string result{};
+  size_t argument_index = 0;
+
+  auto substring = format;
+  while (not substring.empty()) {
+    if (substring.starts_with("%%")) {
+      result += '%';
+      substring.remove_prefix(2);
+    } else if (const auto [is_valid, type_matchers, placeholder_length] = parse_first_placeholder(substring); is_valid) {
+      result += format_placeholder(substring.substr(0, placeholder_length), record, argument_index);
+      argument_index += type_matchers.size();
+      substring.remove_prefix(placeholder_length);
+    } else {
+      result += substring.front();
+      substring.remove_prefix(1);
+    }
+  }
+  return result;
+}
+
+inline std::string escape_json(const std::string_view &text) {
+  std::string result{};
+  for (const char character: text) {
+    switch (character) {
+      case '"':
+        result += "\\\"";
+        break;
+      case '\\':
+        result += "\\\\";
+        break;
+      case '\n':
+        result += "\\n";
+        break;
+      case '\t':
+        result += "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(character) < 0x20) {
+          result += print_formatted("\\u%04x", static_cast<unsigned>(character));
+        } else {
+          result += character;
+        }
+    }
+  }
+  return result;
+}
+
+inline std::string scope_name(const std::map<uint64_t, std::string_view> &call_sites, const Record &record) {
+  if (const auto call_site = call_sites.find(call_site_key(record.file_hash, record.line, record.format_hash));
+          call_site != call_sites.end()) {
+    return format_scope_name(call_site->second, record);
+  }
+  return print_formatted("unknown %08x:%u", record.file_hash, record.line);
+}
+
+// Return records that form properly nested scopes - end records whose begin record was already overwritten in the ring
+// buffer are dropped
+inline std::vector<Record> matched_records(const std::vector<Record> &records) {
+  std::vector<Record> result{};
+  size_t open_scopes = 0;
+  for (const auto &record: records) {
+    if (record.kind == RecordKind::end) {
+      if (open_scopes == 0) {
+        continue;
+      }
+      --open_scopes;
+    } else {
+      ++open_scopes;
+    }
+    result.push_back(record);
+  }
+  return result;
+}
+
+// Write records in Chrome Trace Event format (https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU)
+// that can be opened in Perfetto or chrome://tracing. Timestamps are shown relative to the oldest exported record
+inline void export_chrome_trace(std::ostream &output, const std::vector<ThreadRecords> &threads,
+                                const std::map<uint64_t, std::string_view> &call_sites,
+                                const double ticks_per_microsecond) {
+  std::vector<ThreadRecords> exported_threads{};
+  uint64_t origin = UINT64_MAX;
+  for (const auto &[thread_id, records]: threads) {
+    auto &exported = exported_threads.emplace_back(
+            ThreadRecords{.thread_id = thread_id, .records = matched_records(records)});
+    for (const auto &record: exported.records) {
+      origin = std::min(origin, record.timestamp);
+    }
+  }
+
+  output << R"({"traceEvents":[)";
+  bool is_first_event = true;
+  for (const auto &[thread_id, records]: exported_threads) {
+    for (const auto &record: records) {
+      const double timestamp = static_cast<double>(record.timestamp - origin) / ticks_per_microsecond;
+      output << (is_first_event ? "" : ",");
+      is_first_event = false;
+      if (record.kind == RecordKind::begin) {
+        output << R"({"name":")" << escape_json(scope_name(call_sites, record)) << R"(","cat":"log4tiny","ph":"B",)";
+      } else {
+        output << R"({"ph":"E",)";
+      }
+      output << R"("ts":)" << print_formatted("%.3f", timestamp) << R"(,"pid":1,"tid":)" << thread_id << "}";
+    }
+  }
+  output << R"(],"displayTimeUnit":"ns"})";
+}
+
+}
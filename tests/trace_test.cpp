@@ -0,0 +1,238 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <sstream>
+#include <thread>
+#include <log4tiny.hpp>
+#include <trace_decoder.hpp>
+
+using namespace log4tiny::trace;
+
+struct TraceRecords : testing::Test {
+  static Record make_record(const RecordKind kind, const uint64_t timestamp, const uint32_t line) {
+    return Record{.timestamp = timestamp, .file_hash = 0xABCDU, .line = line, .format_hash = 0, .kind = kind,
+            .argument_count = 0, .argument_kinds = {}, .arguments = {}};
+  }
+
+  template<typename T>
+  static void traced_template(const T value) {
+    const unsigned copy = value;
+    tinytrace_scope("template");
+    tinytrace_scope("template %u %u", value, copy);
+  }
+
+  // Verify that records form a sequence of non-overlapping "worker" scopes with consecutive ids
+  static testing::AssertionResult is_worker_sequence(const std::vector<Record> &records,
+                                                     const std::map<uint64_t, std::string_view> &sites) {
+    if (not records.empty() and not scope_name(sites, records.front()).starts_with("worker")) {
+      return testing::AssertionFailure() << "first record is named " << scope_name(sites, records.front());
+    }
+    for (size_t index = 0; index < records.size(); ++index) {
+      const auto &record = records.at(index);
+      if (call_site_key(record.file_hash, record.line, record.format_hash) !=
+          call_site_key(records.front().file_hash, records.front().line, records.front().format_hash)) {
+        return testing::AssertionFailure() << "record " << index << " is named " << scope_name(sites, record);
+      }
+      if (index > 0 and (record.kind == records.at(index - 1).kind or
+                         record.timestamp < records.at(index - 1).timestamp)) {
+        return testing::AssertionFailure() << "record " << index << " is out of order";
+      }
+      if (index > 1 and record.kind == RecordKind::begin and
+          record.arguments.at(0) != records.at(index - 2).arguments.at(0) + 1) {
+        return testing::AssertionFailure() << "record " << index << " has unexpected id";
+      }
+    }
+    return testing::AssertionSuccess();
+  }
+
+  static void traced_function(const unsigned id) {
+    tinytrace_scope("outer %u", id);
+    {
+      tinytrace_scope("inner");
+    }
+  }
+};
+
+TEST_F(TraceRecords, EmitsNestedBeginAndEndRecords) {
+  thread_buffer().clear();
+  traced_function(7);
+  const auto records = thread_buffer().snapshot();
+
+  ASSERT_EQ(records.size(), 4);
+  EXPECT_EQ(records.at(0).kind, RecordKind::begin);
+  EXPECT_EQ(records.at(1).kind, RecordKind::begin);
+  EXPECT_EQ(records.at(2).kind, RecordKind::end);
+  EXPECT_EQ(records.at(3).kind, RecordKind::end);
+  EXPECT_EQ(records.at(0).line, records.at(3).line);
+  EXPECT_EQ(records.at(1).line, records.at(2).line);
+  for (size_t index = 1; index < records.size(); ++index) {
+    EXPECT_LE(records.at(index - 1).timestamp, records.at(index).timestamp);
+  }
+
+  ASSERT_EQ(records.at(0).argument_count, 1);
+  EXPECT_EQ(records.at(0).argument_kinds.at(0), ArgumentKind::unsigned_int);
+  EXPECT_EQ(records.at(0).arguments.at(0), 7);
+  EXPECT_EQ(records.at(2).argument_count, 0);
+  EXPECT_EQ(scope_name(call_sites(), records.at(0)), "outer 7");
+  EXPECT_EQ(scope_name(call_sites(), records.at(1)), "inner");
+}
+
+TEST_F(TraceRecords, ScopesOnTheSameLine) {
+  thread_buffer().clear();
+  {
+    tinytrace_scope("first %d", -1); tinytrace_scope("second %.1f", 2.5);
+  }
+  const auto records = thread_buffer().snapshot();
+
+  ASSERT_EQ(records.size(), 4);
+  EXPECT_EQ(records.at(0).kind, RecordKind::begin);
+  EXPECT_EQ(records.at(1).kind, RecordKind::begin);
+  EXPECT_EQ(scope_name(call_sites(), records.at(0)), "first -1");
+  EXPECT_EQ(scope_name(call_sites(), records.at(1)), "second 2.5");
+}
+
+TEST_F(TraceRecords, ScopesInsideTemplate) {
+  thread_buffer().clear();
+  traced_template(5U);
+  traced_template(6UL);
+  const auto records = thread_buffer().snapshot();
+
+  ASSERT_EQ(records.size(), 8);
+  EXPECT_EQ(scope_name(call_sites(), records.at(0)), "template");
+  EXPECT_EQ(scope_name(call_sites(), records.at(1)), "template 5 5");
+  EXPECT_EQ(scope_name(call_sites(), records.at(5)), "template 6 6");
+}
+
+TEST_F(TraceRecords, ConflictingCallSitesAreRejected) {
+  const uint64_t key = call_site_key(0x123U, 5, 0);
+  EXPECT_NO_THROW(CallSite(key, "registered"));
+  EXPECT_NO_THROW(CallSite(key, "registered"));
+  EXPECT_THROW(CallSite(key, "other"), std::logic_error);
+}
+
+TEST_F(TraceRecords, RingBufferKeepsNewestRecords) {
+  thread_buffer().clear();
+  const size_t record_count = buffer_capacity / record_header_words + 2;
+  for (size_t index = 0; index < record_count; ++index) {
+    thread_buffer().push(make_record(RecordKind::begin, index, 1));
+  }
+  const auto records = thread_buffer().snapshot();
+
+  ASSERT_EQ(records.size(), buffer_capacity / record_header_words);
+  EXPECT_EQ(records.front().timestamp, 2);
+  EXPECT_EQ(records.back().timestamp, record_count - 1);
+  thread_buffer().clear();
+}
+
+TEST_F(TraceRecords, RingBufferSkipsPartiallyOverwrittenRecords) {
+  thread_buffer().clear();
+  for (size_t index = 0; index < buffer_capacity; ++index) {
+    Record record = make_record(index % 2 ? RecordKind::end : RecordKind::begin, index, 1);
+    record.argument_count = index % (max_scope_arguments + 1);
+    record.arguments.fill(index);
+    thread_buffer().push(record);
+  }
+  const auto records = thread_buffer().snapshot();
+
+  ASSERT_FALSE(records.empty());
+  EXPECT_EQ(records.back().timestamp, buffer_capacity - 1);
+  for (size_t index = 1; index < records.size(); ++index) {
+    EXPECT_EQ(records.at(index).timestamp, records.at(index - 1).timestamp + 1);
+  }
+  for (const auto &record: records) {
+    EXPECT_EQ(record.argument_count, record.timestamp % (max_scope_arguments + 1));
+    for (size_t index = 0; index < record.argument_count; ++index) {
+      EXPECT_EQ(record.arguments.at(index), record.timestamp);
+    }
+  }
+  thread_buffer().clear();
+}
+
+TEST_F(TraceRecords, CollectWhileOtherThreadIsTracing) {
+  std::atomic<bool> is_running{true};
+  std::atomic<uint32_t> worker_thread_id{0};
+  std::thread worker{[&] {
+    for (unsigned iteration = 0; is_running; ++iteration) {
+      {
+        tinytrace_scope("worker %u", iteration);
+      }
+      // Published after the first scope, so its call site is already registered
+      if (iteration == 0) {
+        worker_thread_id = thread_buffer().get_thread_id();
+      }
+    }
+  }};
+  while (worker_thread_id == 0) {
+  }
+
+  const auto sites = call_sites();
+  for (int collection = 0; collection < 20; ++collection) {
+    const auto threads = collect_records();
+    const auto worker_records = std::ranges::find(threads, worker_thread_id.load(), &ThreadRecords::thread_id);
+    EXPECT_NE(worker_records, threads.end());
+    const auto result = worker_records == threads.end() ? testing::AssertionFailure() << "worker not collected" :
+                        is_worker_sequence(worker_records->records, sites);
+    EXPECT_TRUE(result);
+    if (not result) {
+      break;
+    }
+  }
+  is_running = false;
+  worker.join();
+}
+
+TEST_F(TraceRecords, BuffersOfExitedThreadsAreReused) {
+  for (int thread_index = 0; thread_index < 100; ++thread_index) {
+    std::thread{[] { traced_function(1); }}.join();
+  }
+  {
+    const std::lock_guard lock{registry().mutex};
+    EXPECT_LE(registry().retired.size(), max_retired_buffers);
+    EXPECT_LE(registry().free.size(), max_retired_buffers);
+  }
+
+  const uint32_t last_thread_id = [] {
+    std::atomic<uint32_t> thread_id{0};
+    std::thread{[&] {
+      traced_function(2);
+      thread_id = thread_buffer().get_thread_id();
+    }}.join();
+    return thread_id.load();
+  }();
+  const auto has_last_thread = [last_thread_id](const std::vector<ThreadRecords> &threads) {
+    return std::ranges::any_of(threads, [last_thread_id](const auto &thread) {
+      return thread.thread_id == last_thread_id;
+    });
+  };
+  // Records of exited thread are reported once, afterwards its buffer is handed to other threads
+  EXPECT_TRUE(has_last_thread(collect_records()));
+  EXPECT_FALSE(has_last_thread(collect_records()));
+}
+
+TEST_F(TraceRecords, FormatScopeName) {
+  Record record = make_record(RecordKind::begin, 0, 1);
+  record.argument_count = 4;
+  record.argument_kinds = {ArgumentKind::signed_int, ArgumentKind::floating, ArgumentKind::unsigned_int,
+                           ArgumentKind::signed_int};
+  record.arguments = {encode_argument(-3), encode_argument(1.5), encode_argument(4U), encode_argument(42)};
+
+  EXPECT_EQ(format_scope_name("id %hhd value %.2f %*ld %%", record), "id -3 value 1.50   42 %");
+  // Missing arguments leave placeholders untouched
+  EXPECT_EQ(format_scope_name("%d %d %d %d %d", record), "-3 1 4 42 %d");
+  // Integers are truncated to the type implied by the length modifier like in printf
+  EXPECT_EQ(format_scope_name("%x %hhd %hx %lld", record), "fffffffd 1 4 42");
+}
+
+TEST_F(TraceRecords, ExportChromeTrace) {
+  const std::vector<ThreadRecords> threads{
+          ThreadRecords{.thread_id = 3, .records = {make_record(RecordKind::end, 90, 2),
+                                                    make_record(RecordKind::begin, 100, 1),
+                                                    make_record(RecordKind::end, 300, 1)}}};
+  const std::map<uint64_t, std::string_view> sites{{call_site_key(0xABCDU, 1, 0), R"(quoted "scope")"}};
+  std::ostringstream output{};
+  export_chrome_trace(output, threads, sites, 2.0);
+
+  // Orphaned end record is dropped and does not shift timestamps
+  EXPECT_EQ(output.str(), R"({"traceEvents":[)"
+                          R"({"name":"quoted \"scope\"","cat":"log4tiny","ph":"B","ts":0.000,"pid":1,"tid":3},)"
+                          R"({"ph":"E","ts":100.000,"pid":1,"tid":3}],"displayTimeUnit":"ns"})");
+}